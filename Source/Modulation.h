@@ -0,0 +1,153 @@
+/* ==============================================================================
+    Modulation.h
+    Author:  Fernando Quinones Fernandez - https://fQfdev.com
+  ============================================================================== */
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+enum class ModTarget { cutoff, resonance, gain };
+static constexpr int numModTargets = 3;
+
+// Tempo-synced LFO rates, as note length per cycle (in quarter-note beats).
+static constexpr std::array<double, 5> lfoBeatsPerCycle { 4.0, 2.0, 1.0, 0.5, 0.25 };
+static constexpr std::array<const char*, 5> lfoRateNames { "1/1", "1/2", "1/4", "1/8", "1/16" };
+
+//==============================================================================
+// Modulation for one block, sampled at control rate. Segment k ends at
+// getSegmentEnd(k) and get(target, k) is the modulation amount at that point;
+// stages ramp linearly from the previous point to it.
+struct ModulationBlock
+{
+    static constexpr int controlInterval = 32; // samples between control points
+
+    void prepare(int samplesPerBlock)
+    {
+        capacity = samplesPerBlock / controlInterval + 1;
+        for (auto& target : values)
+            target.assign((size_t) capacity, 0.0f);
+        numSamples = 0;
+        numSegments = 0;
+    }
+
+    // Blocks bigger than prepared for stretch the last segment rather than allocate.
+    void setNumSamples(int newNumSamples)
+    {
+        numSamples  = newNumSamples;
+        numSegments = juce::jmin(capacity, (numSamples + controlInterval - 1) / controlInterval);
+    }
+
+    int getSegmentEnd(int segment) const
+    {
+        return segment == numSegments - 1 ? numSamples : (segment + 1) * controlInterval;
+    }
+
+    float get(ModTarget target, int segment) const { return values[(size_t) target][(size_t) segment]; }
+
+    int numSamples  {0};
+    int numSegments {0};
+    int capacity    {0};
+    std::array<std::vector<float>, numModTargets> values;
+};
+
+//==============================================================================
+// A tempo-synced sine LFO and an input envelope follower, both evaluated once
+// per control point and mixed into a ModulationBlock by their depth parameters.
+class ModulationSources
+{
+public:
+    ModulationSources(juce::AudioProcessorValueTreeState& vts)
+    {
+        lfoRateParam = vts.getRawParameterValue ("lfoRate");
+        lfoDepthParams = { vts.getRawParameterValue ("lfoFreqDepth"),
+                           vts.getRawParameterValue ("lfoResonanceDepth"),
+                           vts.getRawParameterValue ("lfoGainDepth") };
+        envDepthParams = { vts.getRawParameterValue ("envFreqDepth"),
+                           vts.getRawParameterValue ("envResonanceDepth"),
+                           vts.getRawParameterValue ("envGainDepth") };
+    }
+
+    void prepare(double sampleRate, int samplesPerBlock)
+    {
+        currentSampleRate = sampleRate;
+        block.prepare(samplesPerBlock);
+
+        // one-pole coefficients per control interval, not per sample
+        const double intervalSeconds = ModulationBlock::controlInterval / sampleRate;
+        envAttack  = (float) std::exp(-intervalSeconds / 0.01);
+        envRelease = (float) std::exp(-intervalSeconds / 0.15);
+
+        lfoPhase = 0.0;
+        envelope = 0.0f;
+    }
+
+    void process(const juce::AudioBuffer<float>& input, juce::AudioPlayHead* playHead)
+    {
+        block.setNumSamples(input.getNumSamples());
+
+        const int rateIndex = juce::jlimit(0, (int) lfoBeatsPerCycle.size() - 1, juce::roundToInt(lfoRateParam->load()));
+        const double beatsPerCycle = lfoBeatsPerCycle[(size_t) rateIndex];
+        double bpm = 120.0;
+
+        if (playHead != nullptr)
+        {
+            if (auto position = playHead->getPosition())
+            {
+                if (auto hostBpm = position->getBpm())
+                    bpm = *hostBpm;
+
+                // lock the phase to the song position while the host is playing
+                if (position->getIsPlaying())
+                    if (auto ppq = position->getPpqPosition())
+                        lfoPhase = std::fmod(*ppq / beatsPerCycle, 1.0);
+            }
+        }
+
+        const double phasePerSample = bpm / 60.0 / beatsPerCycle / currentSampleRate;
+
+        std::array<float, numModTargets> lfoDepth, envDepth;
+        for (int target = 0; target < numModTargets; target++)
+        {
+            lfoDepth[(size_t) target] = *lfoDepthParams[(size_t) target];
+            envDepth[(size_t) target] = *envDepthParams[(size_t) target];
+        }
+
+        int start = 0;
+        for (int segment = 0; segment < block.numSegments; segment++)
+        {
+            const int end = block.getSegmentEnd(segment);
+
+            lfoPhase = std::fmod(lfoPhase + phasePerSample * (end - start), 1.0);
+            const float lfo = (float) std::sin(juce::MathConstants<double>::twoPi * lfoPhase);
+
+            float peak = 0.0f;
+            for (int channel = 0; channel < input.getNumChannels(); channel++)
+                peak = juce::jmax(peak, input.getMagnitude(channel, start, end - start));
+            const float coefficient = peak > envelope ? envAttack : envRelease;
+            envelope = juce::jmin(1.0f, peak + coefficient * (envelope - peak));
+
+            for (int target = 0; target < numModTargets; target++)
+                block.values[(size_t) target][(size_t) segment] = lfo * lfoDepth[(size_t) target]
+                                                                + envelope * envDepth[(size_t) target];
+            start = end;
+        }
+    }
+
+    const ModulationBlock& getBlock() const { return block; }
+
+private:
+    std::atomic<float>* lfoRateParam = nullptr;
+    std::array<std::atomic<float>*, numModTargets> lfoDepthParams {};
+    std::array<std::atomic<float>*, numModTargets> envDepthParams {};
+
+    ModulationBlock block;
+    double currentSampleRate {44100.0};
+    double lfoPhase {0.0};
+    float envelope {0.0};
+    float envAttack {0.0};
+    float envRelease {0.0};
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ModulationSources)
+};
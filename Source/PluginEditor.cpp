@@ -28,6 +28,30 @@ StripAudioProcessorEditor::StripAudioProcessorEditor (StripAudioProcessor& p,
     title.setColour(juce::Label::textColourId, juce::Colours::white.darker(0.3));
     title.setJustificationType(juce::Justification::horizontallyCentred);
     addAndMakeVisible(&title);
+    // Stage order ........................................................
+    // Every order and subset of the available stages, listed as e.g. "Filter > Gain".
+    stageOrders.add({ StageType::filter, StageType::gain });
+    stageOrders.add({ StageType::gain,   StageType::filter });
+    stageOrders.add({ StageType::filter });
+    stageOrders.add({ StageType::gain });
+    stageOrders.add(juce::Array<StageType>());
+
+    for (int i = 0; i < stageOrders.size(); i++)
+    {
+        juce::StringArray names;
+        for (auto type : stageOrders[i])
+            names.add(stageTypeToString(type).substring(0, 1).toUpperCase() + stageTypeToString(type).substring(1));
+        stageOrderBox.addItem(names.isEmpty() ? juce::String("Thru") : names.joinIntoString(" > "), i + 1);
+    }
+
+    const int currentOrder = stageOrders.indexOf(audioProcessor.getStageLayout());
+    if (currentOrder >= 0)
+        stageOrderBox.setSelectedId(currentOrder + 1, juce::NotificationType::dontSendNotification);
+    else
+        stageOrderBox.setText("Custom", juce::NotificationType::dontSendNotification); // e.g. from a session template
+
+    stageOrderBox.onChange = [this] { stageOrderChanged(); };
+    addAndMakeVisible(&stageOrderBox);
     // LPF ........................................................
     freqLabel.setText("Cutoff", juce::NotificationType::dontSendNotification);
     freqLabel.setJustificationType(juce::Justification::horizontallyCentred);
@@ -63,8 +87,30 @@ StripAudioProcessorEditor::StripAudioProcessorEditor (StripAudioProcessor& p,
     gainLevelKnob.setTextBoxStyle(juce::Slider::TextBoxBelow, false, 80, 20);
     addAndMakeVisible(&gainLevelKnob);
     gainLevelAttachment.reset(new SliderAttachment(valueTreeState, "gainLevel", gainLevelKnob));
-
-    setSize (400, 200);
+    // Modulation ........................................................
+    const std::array<std::pair<const char*, const char*>, numModKnobs> modControls {{
+        { "lfoRate",           "Rate" },
+        { "lfoFreqDepth",      "LFO F" },
+        { "lfoResonanceDepth", "LFO Q" },
+        { "lfoGainDepth",      "LFO G" },
+        { "envFreqDepth",      "Env F" },
+        { "envResonanceDepth", "Env Q" },
+        { "envGainDepth",      "Env G" } }};
+
+    for (int i = 0; i < numModKnobs; i++)
+    {
+        modLabels[i].setText(modControls[i].second, juce::NotificationType::dontSendNotification);
+        modLabels[i].setJustificationType(juce::Justification::horizontallyCentred);
+        addAndMakeVisible(&modLabels[i]);
+
+        modKnobs[i].setLookAndFeel(&pluginLookAndFeel);
+        modKnobs[i].setSliderStyle(juce::Slider::RotaryHorizontalVerticalDrag);
+        modKnobs[i].setTextBoxStyle(juce::Slider::TextBoxBelow, false, 46, 18);
+        addAndMakeVisible(&modKnobs[i]);
+        modAttachments[i].reset(new SliderAttachment(valueTreeState, modControls[i].first, modKnobs[i]));
+    }
+
+    setSize (400, 320);
 }
 
 StripAudioProcessorEditor::~StripAudioProcessorEditor() 
@@ -72,6 +118,13 @@ StripAudioProcessorEditor::~StripAudioProcessorEditor()
     setLookAndFeel(nullptr);
 }
 
+void StripAudioProcessorEditor::stageOrderChanged()
+{
+    const int index = stageOrderBox.getSelectedId() - 1;
+    if (juce::isPositiveAndBelow(index, stageOrders.size()))
+        audioProcessor.setStageLayout(stageOrders[index]);
+}
+
 void StripAudioProcessorEditor::lpfIsBypassedClicked() {
     auto isBypassed = bool(*valueTreeState.getRawParameterValue ("lpfIsBypassed"));
     audioProcessor.lpfSetBypassed(isBypassed);
@@ -89,6 +142,7 @@ void StripAudioProcessorEditor::paint (juce::Graphics& g)
     auto area = getLocalBounds().reduced(12, 12);
     auto titleArea = area.removeFromTop(45);
     titleArea.removeFromBottom(12);
+    auto modArea = area.removeFromBottom(modRowHeight);
 
     const float width = area.getWidth();
     const float height = area.getHeight();
@@ -108,6 +162,9 @@ void StripAudioProcessorEditor::paint (juce::Graphics& g)
     g.fillRect (lpfAreaCenter);
     g.fillRect (gainArea);
     
+    const float modWidth = modArea.getWidth() / (float) numModKnobs;
+    for (int i = 0; i < numModKnobs; i++)
+        g.fillRect (modArea.removeFromLeft(modWidth).reduced(tileBorderWidth,tileBorderWidth));
 }
 
 
@@ -117,6 +174,7 @@ void StripAudioProcessorEditor::resized()
     auto area = getLocalBounds().reduced(12, 12);
     auto titleArea = area.removeFromTop(45);
     titleArea.removeFromBottom(12);
+    auto modArea = area.removeFromBottom(modRowHeight);
     
     const float width = area.getWidth();
     const float height = area.getHeight();
@@ -130,6 +188,7 @@ void StripAudioProcessorEditor::resized()
     auto lpfAreaCenter      = lpfArea.removeFromLeft(widthThird).reduced(tileBorderWidth,tileBorderWidth);
     auto gainArea           = lpfArea.removeFromLeft(widthThird).reduced(tileBorderWidth,tileBorderWidth);
 
+    stageOrderBox.setBounds(titleArea.removeFromRight(120));
     title.setBounds(titleArea);
 
     freqLabel.setBounds(lpfAreaLeft.removeFromBottom(20));
@@ -140,6 +199,14 @@ void StripAudioProcessorEditor::resized()
     // Gain
     gainLevelLabel.setBounds(gainArea.removeFromBottom(20));
     gainLevelKnob.setBounds(gainArea);
+    // Modulation
+    const float modWidth = modArea.getWidth() / (float) numModKnobs;
+    for (int i = 0; i < numModKnobs; i++)
+    {
+        auto modTile = modArea.removeFromLeft(modWidth).reduced(tileBorderWidth,tileBorderWidth);
+        modLabels[i].setBounds(modTile.removeFromBottom(20));
+        modKnobs[i].setBounds(modTile);
+    }
 }
 
 //--------------------------------------------------------------------------------------
@@ -31,6 +31,7 @@ private:
     void gainIsBypassedClicked();
     void lpfIsBypassedClicked();
     void dlyIsBypassedClicked();
+    void stageOrderChanged();
     
     StripAudioProcessor& audioProcessor;
 
@@ -38,6 +39,10 @@ private:
     juce::AudioProcessorValueTreeState& valueTreeState;
     juce::Label title;
     
+    // Stage order ........................................................
+    juce::ComboBox stageOrderBox;
+    juce::Array<juce::Array<StageType>> stageOrders;
+    
     using SliderAttachment = juce::AudioProcessorValueTreeState::SliderAttachment;
     using ButtonAttachment = juce::AudioProcessorValueTreeState::ButtonAttachment;
     // LPF ........................................................
@@ -55,6 +60,12 @@ private:
     juce::Label  gainLevelLabel;
     juce::Slider gainLevelKnob;
     std::unique_ptr<SliderAttachment> gainLevelAttachment;
+    // Modulation ........................................................
+    static constexpr int numModKnobs = 7;
+    static constexpr int modRowHeight = 120;
+    std::array<juce::Label,  numModKnobs> modLabels;
+    std::array<juce::Slider, numModKnobs> modKnobs;
+    std::array<std::unique_ptr<SliderAttachment>, numModKnobs> modAttachments;
     
     void drawWaveform(juce::Graphics& g, const float* data, juce::Colour color, int yOffset, juce::Rectangle<int> area);
     
@@ -22,6 +22,22 @@ static float qSliderTextToValue(const juce::String& text) {return text.getFloatV
 static float gainLevelSliderTextToValue(const juce::String& text) {return text.getFloatValue();}
 static juce::String gainLevelSliderValueToText(float value) {return juce::String(value, 2) + juce::String(" x");}
 
+// Modulation ........................................................
+static juce::String lfoRateValueToText(float value)
+{
+    const int index = juce::jlimit(0, (int) lfoRateNames.size() - 1, juce::roundToInt(value));
+    return juce::String(lfoRateNames[(size_t) index]);
+}
+static float lfoRateTextToValue(const juce::String& text)
+{
+    for (size_t index = 0; index < lfoRateNames.size(); index++)
+        if (text.trim() == lfoRateNames[index])
+            return (float) index;
+    return 0.0f;
+}
+static juce::String depthSliderValueToText(float value) {return juce::String(value, 2);}
+static float depthSliderTextToValue(const juce::String& text) {return text.getFloatValue();}
+
 juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout() 
 {
     using Parameter = juce::AudioProcessorValueTreeState::Parameter;
@@ -51,71 +67,191 @@ juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout()
                      juce::String("gainIsBypassed"), juce::String("is Gain bypassed"), juce::String(),
                      juce::NormalisableRange<float>(0.0f, 1.0f),
                      0.0f, nullptr, nullptr));
+    // Modulation params ........................................................
+    parameters.push_back(std::make_unique<Parameter> (
+                     juce::String("lfoRate"), juce::String("LFO Rate"), juce::String(),
+                     juce::NormalisableRange<float>(0.0f, (float) (lfoRateNames.size() - 1), 1.0f),
+                     2.0f, lfoRateValueToText, lfoRateTextToValue));
+
+    const std::array<std::pair<const char*, const char*>, 6> depths {{
+        { "lfoFreqDepth",      "LFO > Cutoff" },
+        { "lfoResonanceDepth", "LFO > Resonance" },
+        { "lfoGainDepth",      "LFO > Gain" },
+        { "envFreqDepth",      "Env > Cutoff" },
+        { "envResonanceDepth", "Env > Resonance" },
+        { "envGainDepth",      "Env > Gain" } }};
+
+    for (auto& depth : depths)
+        parameters.push_back(std::make_unique<Parameter> (
+                     juce::String(depth.first), juce::String(depth.second), juce::String(),
+                     juce::NormalisableRange<float>(-1.0f, 1.0f, 0.01f),
+                     0.0f, depthSliderValueToText, depthSliderTextToValue));
 
     return { parameters.begin(), parameters.end() };
 }
 
+//==============================================================================
+static std::atomic<bool> environmentCaptureEnabled { true };
+static std::atomic<int> numInstancesCreated { 0 };
+
+void StripAudioProcessor::setEnvironmentCaptureEnabled(bool isEnabled)
+{
+    environmentCaptureEnabled = isEnabled;
+}
+
 //==============================================================================
 StripAudioProcessor::StripAudioProcessor() :
         AudioProcessor (BusesProperties().withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
                                          .withOutput ("Output", juce::AudioChannelSet::stereo(), true)),
-        mainProcessor  (new juce::AudioProcessorGraph()),
         parameters (*this, nullptr, juce::Identifier(JucePlugin_Name), createParameterLayout())
 {
-
+    // Opt-in session capture for profiling, e.g. SIMPLESTRIP_TRACE=/tmp/session.sstr
+    auto tracePath = juce::SystemStats::getEnvironmentVariable ("SIMPLESTRIP_TRACE", {});
+    if (environmentCaptureEnabled && juce::File::isAbsolutePath (tracePath))
+        startSessionCapture (SessionTrace::makeUniqueTraceFile (juce::File (tracePath), ++numInstancesCreated));
+    
+    startTimer (200); // retired plans are freed from here
 }
 
-StripAudioProcessor::~StripAudioProcessor() {  }
+StripAudioProcessor::~StripAudioProcessor()
+{
+    stopTimer();
+    sessionRecorder.stop();
+    planBuilder.removeAllJobs(true, -1);
+    delete pendingPlan.exchange(nullptr);
+    currentPlan.reset();
+    fadingOutPlan.reset();
+    deleteRetiredPlans();
+}
 
 // -----------------------------------------------------
 void StripAudioProcessor::lpfSetBypassed(bool isBypassed)
 {
-    filterNode->setBypassed(isBypassed);
-    gainNode->setBypassed(isBypassed); // include gain as part of LPF
+    setStageBypassed(StageType::filter, isBypassed);
+    setStageBypassed(StageType::gain, isBypassed); // include gain as part of LPF
+}
+void StripAudioProcessor::setStageBypassed(StageType type, bool isBypassed)
+{
+    stageBypassed[(size_t) type] = isBypassed;
+}
+void StripAudioProcessor::setChannelParallelProcessing(bool isEnabled)
+{
+    channelParallelAllowed = isEnabled;
+    updateChannelPool();
+}
+// Joins the shared pool once the bus is wide enough to have more than one
+// channel group, so it is warm before any offline render starts. Only called
+// from prepareToPlay and setChannelParallelProcessing - hosts may call
+// setNonRealtime from the audio thread, so that stays the base implementation.
+void StripAudioProcessor::updateChannelPool()
+{
+    const juce::ScopedLock sl (channelPoolLock);
+    if (sharedChannelPool != nullptr || ! channelParallelAllowed)
+        return;
+    
+    {
+        const juce::ScopedLock layoutLock (stageLayoutLock);
+        if (preparedNumChannels <= LowpassResonantProcessor::channelsPerGroup)
+            return;
+    }
+    
+    sharedChannelPool = std::make_unique<juce::SharedResourcePointer<SharedChannelPool>>();
+    channelPool = &(*sharedChannelPool)->pool;
 }
 //void StripAudioProcessor::dlySetBypassed(bool isBypassed)
 //{
 //    delayNode->setBypassed(isBypassed);
 //}
 //-----------------------------------------
-void StripAudioProcessor::initialiseGraph()
+void StripAudioProcessor::setStageLayout(const juce::Array<StageType>& newLayout)
 {
-    mainProcessor->clear();
-    audioInputNode  = mainProcessor->addNode (std::make_unique<AudioGraphIOProcessor> (AudioGraphIOProcessor::audioInputNode));
-    audioOutputNode = mainProcessor->addNode (std::make_unique<AudioGraphIOProcessor> (AudioGraphIOProcessor::audioOutputNode));
-    midiInputNode   = mainProcessor->addNode (std::make_unique<AudioGraphIOProcessor> (AudioGraphIOProcessor::midiInputNode));
-    midiOutputNode  = mainProcessor->addNode (std::make_unique<AudioGraphIOProcessor> (AudioGraphIOProcessor::midiOutputNode));
-    filterNode      = mainProcessor->addNode (std::make_unique<LowpassResonantProcessor> (parameters));
-    gainNode        = mainProcessor->addNode (std::make_unique<GainProcessor> (parameters));
+    {
+        const juce::ScopedLock sl (stageLayoutLock);
+        stageLayout = newLayout;
+    }
     
-    // Access the processors created by the graph nodes
-    lowPassFilter       = dynamic_cast<LowpassResonantProcessor*>(filterNode->getProcessor());
-    gainProcessor       = dynamic_cast<GainProcessor*>  (gainNode->getProcessor());
+    planBuilder.addJob([this] { buildPendingPlan(); });
+}
+
+void StripAudioProcessor::setStageLayoutNow(const juce::Array<StageType>& newLayout)
+{
+    {
+        const juce::ScopedLock sl (stageLayoutLock);
+        stageLayout = newLayout;
+    }
     
-    jassert (!(lowPassFilter == nullptr || gainProcessor == nullptr)); // processor is not of types
- 
-    connectAudioNodes();
-    connectMidiNodes();
+    buildPendingPlan();
 }
 
-void StripAudioProcessor::connectAudioNodes()
+void StripAudioProcessor::buildPendingPlan()
 {
-    // TODO: Remove channel count magic number
-    for (int channel = 0; channel < 2; ++channel) {
-        mainProcessor->addConnection ({ { audioInputNode->nodeID,  channel },
-                                        { filterNode->nodeID,      channel } });
-        mainProcessor->addConnection ({ { filterNode->nodeID,      channel },
-                                        { gainNode->nodeID,       channel } });
-        mainProcessor->addConnection ({ { gainNode->nodeID,        channel },
-                                        { audioOutputNode->nodeID,  channel } });
+    juce::Array<StageType> layout;
+    double sampleRate;
+    int samplesPerBlock, numChannels;
+    {
+        const juce::ScopedLock sl (stageLayoutLock);
+        if (preparedBlockSize == 0)
+            return; // prepareToPlay will build it
+        
+        layout          = stageLayout;
+        sampleRate      = preparedSampleRate;
+        samplesPerBlock = preparedBlockSize;
+        numChannels     = preparedNumChannels;
     }
+    
+    auto plan = createPlan(layout, sampleRate, samplesPerBlock, numChannels);
+    
+    // a plan the audio thread hasn't picked up yet is simply replaced
+    delete pendingPlan.exchange(plan.release());
+}
+
+juce::Array<StageType> StripAudioProcessor::getStageLayout() const
+{
+    const juce::ScopedLock sl (stageLayoutLock);
+    return stageLayout;
 }
 
-void StripAudioProcessor::connectMidiNodes()
+std::unique_ptr<ProcessingPlan> StripAudioProcessor::createPlan(const juce::Array<StageType>& layout,
+                                                                 double sampleRate, int samplesPerBlock, int numChannels)
 {
-    mainProcessor->addConnection (
-                        { { midiInputNode->nodeID,  juce::AudioProcessorGraph::midiChannelIndex },
-                          { midiOutputNode->nodeID, juce::AudioProcessorGraph::midiChannelIndex } });
+    auto plan = std::make_unique<ProcessingPlan>(layout, parameters, modulation.getBlock());
+    plan->prepare(sampleRate, samplesPerBlock, numChannels);
+    return plan;
+}
+
+bool StripAudioProcessor::retirePlan(std::unique_ptr<ProcessingPlan>& plan)
+{
+    int start1, size1, start2, size2;
+    retiredFifo.prepareToWrite(1, start1, size1, start2, size2);
+    if (size1 == 0)
+        return false; // full - try again next block
+    
+    retiredPlans[(size_t) start1] = plan.release();
+    retiredFifo.finishedWrite(1);
+    return true;
+}
+
+// Called from the timer, prepareToPlay and the destructor. AbstractFifo only
+// allows one reader at a time, so they take turns on retiredReadLock.
+void StripAudioProcessor::deleteRetiredPlans()
+{
+    const juce::ScopedLock sl (retiredReadLock);
+    const int numReady = retiredFifo.getNumReady();
+    int start1, size1, start2, size2;
+    retiredFifo.prepareToRead(numReady, start1, size1, start2, size2);
+    
+    for (int i = 0; i < size1; i++)
+        delete retiredPlans[(size_t) (start1 + i)];
+    for (int i = 0; i < size2; i++)
+        delete retiredPlans[(size_t) (start2 + i)];
+    
+    retiredFifo.finishedRead(size1 + size2);
+}
+
+void StripAudioProcessor::timerCallback()
+{
+    if (retiredFifo.getNumReady() > 0)
+        deleteRetiredPlans();
 }
 
 //------------------------------------------------------------------------------
@@ -123,18 +259,41 @@ void StripAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
     bufferSize = samplesPerBlock; // used to draw the oscilloscope
     
-    mainProcessor->setPlayConfigDetails (getMainBusNumInputChannels(),
-                                         getMainBusNumOutputChannels(),
-                                         sampleRate, samplesPerBlock);
-
-    mainProcessor->prepareToPlay (sampleRate, samplesPerBlock);
-
-    initialiseGraph();
+    const int numChannels = juce::jmax(getTotalNumInputChannels(), getTotalNumOutputChannels());
+    juce::Array<StageType> layout;
+    {
+        const juce::ScopedLock sl (stageLayoutLock);
+        preparedSampleRate  = sampleRate;
+        preparedBlockSize   = samplesPerBlock;
+        preparedNumChannels = numChannels;
+        layout = stageLayout;
+    }
+    
+    // Plans built for the old config are no use any more, and the audio thread
+    // is stopped here, so the whole chain can be rebuilt in place.
+    planBuilder.removeAllJobs(true, -1);
+    delete pendingPlan.exchange(nullptr);
+    fadingOutPlan.reset();
+    deleteRetiredPlans();
+    modulation.prepare(sampleRate, samplesPerBlock);
+    currentPlan = createPlan(layout, sampleRate, samplesPerBlock, numChannels);
+    
+    crossfadeLength    = juce::roundToInt(sampleRate * 0.01); // 10 ms
+    crossfadeRemaining = 0;
+    crossfadeMaxChannels = numChannels;
+    crossfadeMaxSamples  = samplesPerBlock;
+    crossfadeBuffer.setSize(numChannels, samplesPerBlock);
     
-    // Oscilloscope: clear visualBuffer
+    // the pool's threads are started here, never from processBlock
+    updateChannelPool();
+    
+    sessionRecorder.recordPrepare(sampleRate, samplesPerBlock, numChannels);
+    sessionRecorder.recordLayout(layout, true);
+    
+    // Oscilloscope: allocate and clear visualBuffer - processBlock only copies into it
     for (int channel = 0; channel < 2; channel++) {
-        visualBuffer[channel].reset( new float[static_cast<int>(bufferSize) + 1]);
-        for (int i = 0; i < static_cast<int>(bufferSize) + 1; i++) {
+        visualBuffer[channel].reset( new float[static_cast<int>(bufferSize)]);
+        for (int i = 0; i < static_cast<int>(bufferSize); i++) {
             visualBuffer[channel][i] = 0.0f;
         }
     }
@@ -142,7 +301,10 @@ void StripAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 
 void StripAudioProcessor::releaseResources()
 {
-    mainProcessor->releaseResources();
+    sessionRecorder.recordRelease();
+    
+    if (currentPlan != nullptr)
+        currentPlan->release();
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -152,12 +314,9 @@ bool StripAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) co
     juce::ignoreUnused (layouts);
     return true;
   #else
-    // This is the place where you check if the layout is supported.
-    // In this template code we only support mono or stereo.
-    // Some plugin hosts, such as certain GarageBand versions, will only
-    // load plugins that support stereo bus layouts.
-    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono()
-     && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+    // Every stage works per channel, so any layout is fine - mono, stereo,
+    // surround, discrete or ambisonic - as long as the bus isn't disabled.
+    if (layouts.getMainOutputChannelSet().isDisabled())
         return false;
 
     // This checks if the input layout matches the output layout
@@ -178,18 +337,156 @@ void StripAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::
     for (int i = getTotalNumInputChannels(); i < getTotalNumOutputChannels(); ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
     
-    mainProcessor->processBlock (buffer, midiMessages);
+    // swap plans before capturing, so a trace records the layout ahead of its first block
+    takePendingPlan();
     
-    // Copy audio data to the buffer for visualization
+    if (sessionRecorder.isCapturing())
+        captureBlock (buffer);
+    
+    // LFO and envelope follower run at control rate, ahead of the stages that read them
+    modulation.process (buffer, getPlayHead());
+    processPlans (buffer, midiMessages);
+    
+    // Copy audio data to the buffer for visualization - first two channels, mono shown twice
+    const int numVisualSamples = juce::jmin(buffer.getNumSamples(), bufferSize);
     for (int channel = 0; channel < 2; channel++) {
-        visualBuffer[channel].reset( new float[static_cast<int>(buffer.getNumSamples()) + 1]);
-        auto data = buffer.getReadPointer(channel);
-        for (int i = 0; i < static_cast<int>(buffer.getNumSamples()) + 1; i++) {
+        auto data = buffer.getReadPointer(juce::jmin(channel, buffer.getNumChannels() - 1));
+        for (int i = 0; i < numVisualSamples; i++) {
             visualBuffer[channel][i] = data[i];
         }
     }
  
 }
+
+void StripAudioProcessor::takePendingPlan()
+{
+    // Pick up a newly built plan at the block boundary, once any previous
+    // crossfade has finished.
+    if (fadingOutPlan != nullptr)
+        return;
+    
+    if (auto* nextPlan = pendingPlan.exchange(nullptr))
+    {
+        fadingOutPlan = std::move(currentPlan);
+        currentPlan.reset(nextPlan);
+        crossfadeRemaining = crossfadeLength;
+        
+        sessionRecorder.recordLayout(currentPlan->getLayout(), false);
+    }
+}
+
+void StripAudioProcessor::processPlans (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
+{
+    if (currentPlan == nullptr)
+        return;
+    
+    auto* pool = isNonRealtime() && channelParallelAllowed ? channelPool.load() : nullptr;
+    currentPlan->setChannelPool(pool);
+    
+    const int numChannels = juce::jmin(buffer.getNumChannels(), crossfadeMaxChannels);
+    const int numSamples  = buffer.getNumSamples();
+    
+    // Blocks larger than prepared can't be crossfaded without allocating,
+    // so they switch over straight away.
+    if (fadingOutPlan != nullptr && numSamples > crossfadeMaxSamples)
+        crossfadeRemaining = 0;
+    
+    if (fadingOutPlan != nullptr && crossfadeRemaining > 0)
+    {
+        fadingOutPlan->setChannelPool(pool);
+        
+        crossfadeBuffer.setSize(numChannels, numSamples, false, false, true);
+        for (int channel = 0; channel < numChannels; channel++)
+            crossfadeBuffer.copyFrom(channel, 0, buffer, channel, 0, numSamples);
+        crossfadeMidi.clear();
+        
+        fadingOutPlan->process(crossfadeBuffer, crossfadeMidi, stageBypassed);
+        currentPlan->process(buffer, midiMessages, stageBypassed);
+        
+        const int fadeStart = crossfadeLength - crossfadeRemaining;
+        for (int channel = 0; channel < numChannels; channel++)
+        {
+            auto* newData = buffer.getWritePointer(channel);
+            auto* oldData = crossfadeBuffer.getReadPointer(channel);
+            
+            for (int sample = 0; sample < numSamples; sample++)
+            {
+                const float fadeIn = juce::jmin(1.0f, (float) (fadeStart + sample + 1) / (float) crossfadeLength);
+                newData[sample] = oldData[sample] + fadeIn * (newData[sample] - oldData[sample]);
+            }
+        }
+        
+        crossfadeRemaining = juce::jmax(0, crossfadeRemaining - numSamples);
+    }
+    else
+    {
+        currentPlan->process(buffer, midiMessages, stageBypassed);
+    }
+    
+    if (fadingOutPlan != nullptr && crossfadeRemaining == 0)
+        retirePlan(fadingOutPlan);
+}
+
+//------------------------------------------------------------------------------
+bool StripAudioProcessor::startSessionCapture (const juce::File& traceFile, int ringBytes)
+{
+    juce::StringArray parameterIDs;
+    std::vector<std::atomic<float>*> parameterValues;
+    for (auto* parameter : getParameters())
+    {
+        if (auto* ranged = dynamic_cast<juce::RangedAudioParameter*> (parameter))
+        {
+            parameterIDs.add (ranged->paramID);
+            parameterValues.push_back (parameters.getRawParameterValue (ranged->paramID));
+        }
+    }
+    
+    double sampleRate;
+    int blockSize, numChannels;
+    {
+        const juce::ScopedLock sl (stageLayoutLock);
+        sampleRate  = preparedSampleRate;
+        blockSize   = preparedBlockSize;
+        numChannels = preparedNumChannels;
+    }
+    
+    return sessionRecorder.start (traceFile, parameterIDs, parameterValues,
+                                  stageLayoutToString (getStageLayout()),
+                                  sampleRate, blockSize, numChannels, ringBytes);
+}
+
+void StripAudioProcessor::stopSessionCapture()
+{
+    sessionRecorder.stop();
+}
+
+// Records the block as it arrives, before any stage has touched it.
+void StripAudioProcessor::captureBlock (const juce::AudioBuffer<float>& buffer)
+{
+    juce::uint8 flags = 0;
+    if (stageBypassed[(size_t) StageType::filter]) flags |= SessionTrace::filterBypassed;
+    if (stageBypassed[(size_t) StageType::gain])   flags |= SessionTrace::gainBypassed;
+    if (isNonRealtime())                           flags |= SessionTrace::nonRealtime;
+    
+    double bpm = 0.0, ppq = 0.0;
+    if (auto* playHead = getPlayHead())
+    {
+        if (auto position = playHead->getPosition())
+        {
+            if (auto hostBpm = position->getBpm())
+                bpm = *hostBpm;
+            
+            if (position->getIsPlaying())
+            {
+                flags |= SessionTrace::hostPlaying;
+                if (auto hostPpq = position->getPpqPosition())
+                    ppq = *hostPpq;
+            }
+        }
+    }
+    
+    sessionRecorder.recordBlock (buffer, flags, bpm, ppq);
+}
 //------------------------------------------------------------------------------
 bool StripAudioProcessor::hasEditor() const
 {
@@ -262,6 +559,7 @@ void StripAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
 // From tutorial 0502:
         auto state = parameters.copyState();
+        state.setProperty ("stages", stageLayoutToString (getStageLayout()), nullptr);
         std::unique_ptr<juce::XmlElement> xml (state.createXml());
         copyXmlToBinary (*xml, destData);
     
@@ -275,7 +573,12 @@ void StripAudioProcessor::setStateInformation (const void* data, int sizeInBytes
     std::unique_ptr<juce::XmlElement> xmlState (getXmlFromBinary (data, sizeInBytes));
         if (xmlState.get() != nullptr)
             if (xmlState->hasTagName (parameters.state.getType()))
+            {
                 parameters.replaceState (juce::ValueTree::fromXml (*xmlState));
+                
+                if (parameters.state.hasProperty ("stages"))
+                    setStageLayout (stageLayoutFromString (parameters.state.getProperty ("stages")));
+            }
 }
 
 // used to draw the oscilloscope
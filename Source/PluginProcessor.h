@@ -12,14 +12,14 @@
 
 #include <JuceHeader.h>
 #include "Processors.h"
+#include "ProcessingPlan.h"
+#include "SessionTrace.h"
 
 //==============================================================================
-class StripAudioProcessor  : public juce::AudioProcessor
+class StripAudioProcessor  : public juce::AudioProcessor,
+                             private juce::Timer
 {
 public:
-    using AudioGraphIOProcessor = juce::AudioProcessorGraph::AudioGraphIOProcessor;
-    using Node = juce::AudioProcessorGraph::Node;
-
     StripAudioProcessor();
     ~StripAudioProcessor() override;
 
@@ -55,34 +55,93 @@ public:
     
     void lpfSetBypassed(bool isBypassed);
     void dlySetBypassed(bool isBypassed);
+    void setStageBypassed(StageType type, bool isBypassed);
+    
+    // While the host renders offline (isNonRealtime), buses wider than one filter
+    // channel group are split across a worker pool shared by all instances. It
+    // is never used in realtime, where waiting on workers could cause dropouts.
+    // On by default; this switches it off.
+    void setChannelParallelProcessing(bool isEnabled);
+    
+    // Order of the stages in the strip. Setting it builds a new plan in the
+    // background, which the audio thread crossfades to at the next block.
+    void setStageLayout(const juce::Array<StageType>& newLayout);
+    // Builds the plan on the calling thread instead, for offline tools such as
+    // trace replay - it's picked up, with a crossfade, at the next block.
+    void setStageLayoutNow(const juce::Array<StageType>& newLayout);
+    juce::Array<StageType> getStageLayout() const;
+    
+    // Opt-in capture of block sizes, input audio, parameters and bypass states
+    // to a trace file, for replaying through Tools/TraceReplay. Fails if the file
+    // already exists. Also started by setting the SIMPLESTRIP_TRACE environment
+    // variable to an absolute path, which each instance makes unique (see
+    // SessionTrace::makeUniqueTraceFile) - unless disabled before construction.
+    bool startSessionCapture(const juce::File& traceFile, int ringBytes = 16 * 1024 * 1024);
+    void stopSessionCapture();
+    static void setEnvironmentCaptureEnabled(bool isEnabled);
     
     // Oscilloscope buffer - array containing two unique pointers to float arrays.
     std::array<std::unique_ptr<float[]>, 2> visualBuffer;
     int getBufferSize(); // used to draw the oscilloscope
     
 private:
-    void initialiseGraph();
-    void connectAudioNodes();
-    void connectMidiNodes();
+    std::unique_ptr<ProcessingPlan> createPlan(const juce::Array<StageType>& layout,
+                                               double sampleRate, int samplesPerBlock, int numChannels);
+    void buildPendingPlan();
+    void takePendingPlan(); // audio thread
+    void processPlans(juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages);
+    bool retirePlan(std::unique_ptr<ProcessingPlan>& plan); // audio thread
+    void deleteRetiredPlans();                              // never on the audio thread
+    void timerCallback() override;                          // frees retired plans
+    void captureBlock(const juce::AudioBuffer<float>& buffer);
+    
+    void updateChannelPool();
     
-    // AudioProcessorGraph
-    std::unique_ptr<juce::AudioProcessorGraph> mainProcessor;
+    // Shared worker pool for channel-parallel processing, acquired in prepareToPlay
+    // once the bus is wide enough - declared before the plans so it outlives their filters.
+    std::unique_ptr<juce::SharedResourcePointer<SharedChannelPool>> sharedChannelPool;
+    std::atomic<juce::ThreadPool*> channelPool {nullptr};
+    std::atomic<bool> channelParallelAllowed {true};
+    juce::CriticalSection channelPoolLock;
     
-    // Audiograph Nodes
-    Node::Ptr filterNode;
-    Node::Ptr gainNode;
-    Node::Ptr audioInputNode;
-    Node::Ptr audioOutputNode;
-    Node::Ptr midiInputNode;
-    Node::Ptr midiOutputNode;
+    // Stage layout and the play config new plans are prepared with
+    juce::Array<StageType> stageLayout { StageType::filter, StageType::gain };
+    double preparedSampleRate {0.0};
+    int preparedBlockSize {0};
+    int preparedNumChannels {0};
+    juce::CriticalSection stageLayoutLock;
     
-    // Audio Processors
-               GainProcessor* gainProcessor;
-    LowpassResonantProcessor* lowPassFilter;
+    // Processing plans - current and fadingOut belong to the audio thread
+    std::unique_ptr<ProcessingPlan> currentPlan;
+    std::unique_ptr<ProcessingPlan> fadingOutPlan;
+    std::atomic<ProcessingPlan*> pendingPlan {nullptr};
+    StageBypassFlags stageBypassed {};
+    
+    // Plans the audio thread is done with, waiting to be deleted elsewhere
+    static constexpr int retiredCapacity = 8;
+    juce::AbstractFifo retiredFifo {retiredCapacity};
+    std::array<ProcessingPlan*, retiredCapacity> retiredPlans {};
+    juce::CriticalSection retiredReadLock; // the fifo has several consumer threads
+    
+    // Crossfade between the outgoing and incoming plan
+    juce::AudioBuffer<float> crossfadeBuffer;
+    juce::MidiBuffer crossfadeMidi;
+    int crossfadeMaxChannels {0};
+    int crossfadeMaxSamples {0};
+    int crossfadeLength {0};
+    int crossfadeRemaining {0};
+    
+    // Builds plans off the audio thread - stopped in the destructor before any plan is freed
+    juce::ThreadPool planBuilder {1};
     
     // parameters ValueTree
     juce::AudioProcessorValueTreeState parameters;
     
+    // Control-rate modulation sources, read by the stages of every plan
+    ModulationSources modulation { parameters };
+    
+    SessionRecorder sessionRecorder;
+    
     int bufferSize {0};
     
     //------------------------------------------------------------------------------
@@ -0,0 +1,125 @@
+/* ==============================================================================
+    ProcessingPlan.h
+    Author:  Fernando Quinones Fernandez - https://fQfdev.com
+  ============================================================================== */
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "Processors.h"
+
+//==============================================================================
+// Stages that can be placed in the strip. To add a new one, extend this enum,
+// stageTypeToString() and ProcessingPlan::createStage().
+enum class StageType { filter, gain };
+static constexpr int numStageTypes = 2;
+
+using StageBypassFlags = std::array<std::atomic<bool>, numStageTypes>;
+
+inline juce::String stageTypeToString(StageType type)
+{
+    switch (type)
+    {
+        case StageType::filter: return "filter";
+        case StageType::gain:   return "gain";
+    }
+    return {};
+}
+
+// Serialised as a comma separated list of stage IDs, e.g. "filter,gain".
+// Unknown IDs are skipped so that older builds can open newer sessions.
+inline juce::String stageLayoutToString(const juce::Array<StageType>& layout)
+{
+    juce::StringArray ids;
+    for (auto type : layout)
+        ids.add(stageTypeToString(type));
+    return ids.joinIntoString(",");
+}
+
+inline juce::Array<StageType> stageLayoutFromString(const juce::String& text)
+{
+    juce::Array<StageType> layout;
+    for (auto& id : juce::StringArray::fromTokens(text, ",", {}))
+        for (int type = 0; type < numStageTypes; type++)
+            if (id.trim() == stageTypeToString((StageType) type))
+                layout.add((StageType) type);
+    return layout;
+}
+
+//==============================================================================
+// An ordered chain of stages that is built and prepared away from the audio
+// thread, then handed over in one piece. Once published it is only touched by
+// the audio thread until it is retired.
+class ProcessingPlan
+{
+public:
+    ProcessingPlan(const juce::Array<StageType>& stageLayout,
+                   juce::AudioProcessorValueTreeState& vts,
+                   const ModulationBlock& modulation)
+        : layout(stageLayout)
+    {
+        for (auto type : layout)
+        {
+            stages.push_back({ type, createStage(type, vts, modulation) });
+
+            if (auto* filter = dynamic_cast<LowpassResonantProcessor*>(stages.back().processor.get()))
+                filters.push_back(filter);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    void prepare(double sampleRate, int samplesPerBlock, int numChannels)
+    {
+        for (auto& stage : stages)
+        {
+            stage.processor->setPlayConfigDetails(numChannels, numChannels, sampleRate, samplesPerBlock);
+            stage.processor->prepareToPlay(sampleRate, samplesPerBlock);
+        }
+    }
+
+    void process(juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages, const StageBypassFlags& bypassed)
+    {
+        for (auto& stage : stages)
+            if (! bypassed[(size_t) stage.type])
+                stage.processor->processBlock(buffer, midiMessages);
+    }
+
+    void release()
+    {
+        for (auto& stage : stages)
+            stage.processor->releaseResources();
+    }
+
+    const juce::Array<StageType>& getLayout() const { return layout; }
+
+    void setChannelPool(juce::ThreadPool* pool)
+    {
+        for (auto* filter : filters)
+            filter->setChannelPool(pool);
+    }
+
+private:
+    static std::unique_ptr<ProcessorBase> createStage(StageType type, juce::AudioProcessorValueTreeState& vts,
+                                                      const ModulationBlock& modulation)
+    {
+        switch (type)
+        {
+            case StageType::filter: return std::make_unique<LowpassResonantProcessor>(vts, modulation);
+            case StageType::gain:   return std::make_unique<GainProcessor>(vts, modulation);
+        }
+        jassertfalse;
+        return {};
+    }
+
+    struct Stage
+    {
+        StageType type;
+        std::unique_ptr<ProcessorBase> processor;
+    };
+
+    juce::Array<StageType> layout;
+    std::vector<Stage> stages;
+    std::vector<LowpassResonantProcessor*> filters;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ProcessingPlan)
+};
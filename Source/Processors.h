@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include "Modulation.h"
+
 //==============================================================================
 class ProcessorBase : public juce::AudioProcessor
 {
@@ -45,56 +47,206 @@ private:
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ProcessorBase)
 };
 
+//==============================================================================
+// Filter state for a contiguous run of channels. Every group owns its own
+// smoothers and integrator state, so groups can run on different threads.
+struct LowpassChannelGroup
+{
+    static constexpr float modOctaves = 4.0f; // cutoff swing at full modulation depth
+
+    void prepare(double sampleRate, int samplesPerBlock, int first, int count,
+                 float cutoffStart, float resonanceStart, juce::Range<float> cutoffLimits, float increment)
+    {
+        firstChannel = first;
+        numChannels  = count;
+        n3.assign((size_t) count, 0.0f);
+        n4.assign((size_t) count, 0.0f);
+
+        cutoffFreqSmoothed.reset(sampleRate, samplesPerBlock/sampleRate);
+        cutoffFreqSmoothed.setCurrentAndTargetValue(cutoffStart);
+        resonanceSmoothed.reset(sampleRate, samplesPerBlock/sampleRate);
+        resonanceSmoothed.setCurrentAndTargetValue(resonanceStart);
+
+        cutoffRange   = cutoffLimits;
+        timeIncrement = increment;
+        cutoffFreq    = cutoffRange.clipValue(cutoffStart) * timeIncrement;
+        resonance     = resonanceStart;
+    }
+
+    // Coefficients are worked out once per control point, from the smoothed
+    // parameters plus modulation, then ramped linearly across the segment.
+    void process(juce::AudioBuffer<float>& buffer, float cutoffTarget, float resonanceTarget,
+                 const ModulationBlock& modulation)
+    {
+        cutoffFreqSmoothed.setTargetValue(cutoffTarget);
+        resonanceSmoothed.setTargetValue(resonanceTarget);
+
+        const int channels = juce::jmin(numChannels, buffer.getNumChannels() - firstChannel);
+        if (channels <= 0)
+            return;
+
+        float* const* channelData = buffer.getArrayOfWritePointers() + firstChannel;
+
+        int start = 0;
+        for (int segment = 0; segment < modulation.numSegments; segment++)
+        {
+            const int end    = modulation.getSegmentEnd(segment);
+            const int length = end - start;
+
+            const float cutoffEnd = cutoffRange.clipValue(cutoffFreqSmoothed.skip(length)
+                                        * std::exp2(modulation.get(ModTarget::cutoff, segment) * modOctaves)) * timeIncrement;
+            const float resonanceEnd = juce::jlimit(0.0f, 1.0f, resonanceSmoothed.skip(length)
+                                                                + modulation.get(ModTarget::resonance, segment));
+            const float cutoffStep    = (cutoffEnd - cutoffFreq) / (float) length;
+            const float resonanceStep = (resonanceEnd - resonance) / (float) length;
+
+            for (int sample = start; sample < end; sample++)
+            {
+                cutoffFreq += cutoffStep;
+                resonance  += resonanceStep;
+                const float feedback = resonance + (resonance / (1 - cutoffFreq));
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    float& s3 = n3[(size_t) channel];
+                    float& s4 = n4[(size_t) channel];
+                    s3 = s3 + cutoffFreq * (channelData[channel][sample] - s3 + feedback * (s3 - s4));
+                    s4 = s4 + cutoffFreq * (s3 - s4);
+                    channelData[channel][sample] = s4;
+                }
+            }
+
+            // land exactly on the control point so rounding doesn't drift
+            cutoffFreq = cutoffEnd;
+            resonance  = resonanceEnd;
+            start = end;
+        }
+    }
+
+    int firstChannel {0};
+    int numChannels  {0};
+    juce::SmoothedValue<float> cutoffFreqSmoothed;
+    juce::SmoothedValue<float> resonanceSmoothed;
+    juce::Range<float> cutoffRange;
+    float timeIncrement {1.0};
+    float cutoffFreq {0.0}; // cut_lp
+    float resonance {0.0};  // res_lp
+    std::vector<float> n3, n4; // per-channel integrator state
+};
+
+//==============================================================================
+// One worker pool for the whole process, shared by every plugin instance via
+// juce::SharedResourcePointer, so instances don't each start a set of threads.
+struct SharedChannelPool
+{
+    juce::ThreadPool pool { juce::jmax(1, juce::SystemStats::getNumCpus() - 1) };
+};
+
 //==============================================================================
 // TODO: implement bypass toggle - maybe in ProcessorBase
 // simple first-order low-pass filter
 class LowpassResonantProcessor : public ProcessorBase
 {
 public:
-    LowpassResonantProcessor(juce::AudioProcessorValueTreeState& vts)
+    LowpassResonantProcessor(juce::AudioProcessorValueTreeState& vts, const ModulationBlock& mod)
+        : modulation(mod)
     {
         cutoffFreqParam  = vts.getRawParameterValue ("freq");
         resonanceParam   = vts.getRawParameterValue ("resonance");
+
+        const auto& freqRange = vts.getParameterRange ("freq");
+        cutoffRange = { freqRange.start, freqRange.end };
     }
 
-    ~LowpassResonantProcessor() override {}
+    ~LowpassResonantProcessor() override { waitForJobsToLeavePool(); }
+
+    static constexpr int channelsPerGroup = 4;
+
+    //------------------------------------------------------------------------------
+    // Pool to share channel groups out to for the next block, or nullptr to run
+    // them all on the calling thread. Dispatching takes the pool's lock and the
+    // caller blocks until the workers are done, so this is for offline rendering
+    // only. The pool must outlive this processor.
+    void setChannelPool(juce::ThreadPool* pool)
+    {
+        dispatchPool = pool;
+        if (pool != nullptr)
+            channelPool = pool;
+    }
 
     //------------------------------------------------------------------------------
     void prepareToPlay(double sampleRate, int samplesPerBlock) override
     {
         currentSampleRate = (float)sampleRate;
         timeIncrement = 2.0f / currentSampleRate; // time duration between two consecutive samples.
-        
-        cutoffFreqSmoothed.reset(sampleRate, samplesPerBlock/sampleRate);
-        cutoffFreqSmoothed.setCurrentAndTargetValue(*cutoffFreqParam);
-        resonanceSmoothed.reset(sampleRate, samplesPerBlock/sampleRate);
-        resonanceSmoothed.setCurrentAndTargetValue(*resonanceParam);
+
+        const int numChannels = juce::jmax(getTotalNumInputChannels(), getTotalNumOutputChannels());
+        const int numGroups   = juce::jmax(1, (numChannels + channelsPerGroup - 1) / channelsPerGroup);
+
+        groups.resize((size_t) numGroups);
+        for (int group = 0; group < numGroups; group++)
+            groups[(size_t) group].prepare(sampleRate, samplesPerBlock,
+                                           group * channelsPerGroup, channelsPerGroup,
+                                           *cutoffFreqParam, *resonanceParam, cutoffRange, timeIncrement);
+
+        // The calling thread always takes part, so one job fewer than groups is enough.
+        waitForJobsToLeavePool();
+        jobs.clear();
+        for (int job = 1; job < numGroups; job++)
+            jobs.push_back(std::make_unique<ChannelGroupJob>(*this));
     }
 
     void processBlock(juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages) override
     {
-        cutoffFreqSmoothed.setTargetValue(*cutoffFreqParam);
-        resonanceSmoothed.setTargetValue(*resonanceParam);
-            
-        auto* channelDataLeft  = buffer.getWritePointer (0);
-        auto* channelDataRight = buffer.getWritePointer (1);
-        
-        for (int sample = 0; sample < buffer.getNumSamples(); sample++)
+        currentBuffer   = &buffer;
+        cutoffTarget    = *cutoffFreqParam;
+        resonanceTarget = *resonanceParam;
+        nextGroup       = 0;
+
+        // The audio thread holds one count itself, so the event only fires once
+        // both it and every dispatched job are done with the buffer.
+        pendingJobs = 1;
+
+        if (auto* pool = dispatchPool.load())
         {
-            cutoffFreq = cutoffFreqSmoothed.getNextValue() * timeIncrement;
-            resonance = resonanceSmoothed.getNextValue();
-            feedback = resonance + (resonance / (1 - cutoffFreq));
-                
-            // left channel
-            ln3 = ln3 + cutoffFreq * (channelDataLeft[sample] - ln3 + (feedback * (ln3-ln4)));
-            ln4 = ln4 + cutoffFreq * (ln3-ln4);
-            channelDataLeft[sample] = ln4;
-                
-            // right channel
-            rn3= rn3 + cutoffFreq * (channelDataRight[sample] - rn3 + feedback * (rn3 - rn4));
-            rn4 = rn4 + cutoffFreq * (rn3 - rn4);
-            channelDataRight[sample] = rn4;
+            const int numJobs = juce::jmin((int) jobs.size(), pool->getNumThreads());
+            for (int job = 0; job < numJobs; job++)
+            {
+                auto* groupJob = jobs[(size_t) job].get();
+                groupJob->dispatched = false;
+
+                // a job from the previous block may still be leaving the pool
+                if (pool->contains(groupJob))
+                    continue;
+
+                ++pendingJobs;
+                groupJob->claimed    = false;
+                groupJob->dispatched = true;
+                pool->addJob(groupJob, false);
+            }
         }
+
+        processPendingGroups();
+
+        // Every group is done or being processed by now. Jobs still queued behind
+        // other instances' work are withdrawn rather than waited for - claiming one
+        // first means it does nothing if a worker picks it up in the meantime.
+        if (auto* pool = dispatchPool.load())
+        {
+            for (auto& groupJob : jobs)
+            {
+                if (groupJob->dispatched && ! groupJob->claimed.exchange(true))
+                {
+                    pool->removeJob(groupJob.get(), false, 0);
+                    --pendingJobs;
+                }
+            }
+        }
+
+        if (--pendingJobs != 0)
+            jobsFinished.wait();
+
+        currentBuffer = nullptr;
     }
 
     void releaseResources() override {}
@@ -102,18 +254,66 @@ public:
     const juce::String getName() const override { return "LowpassResonantProcessor"; }
 
 private:
+    // Pool workers and the audio thread pull groups from the same counter until
+    // none are left, so a slow worker never holds the others back.
+    void processPendingGroups()
+    {
+        for (int group = nextGroup++; group < (int) groups.size(); group = nextGroup++)
+            groups[(size_t) group].process(*currentBuffer, cutoffTarget, resonanceTarget, modulation);
+    }
+
+    // Jobs return to the pool just after signalling, so give them a moment to
+    // be released before they are destroyed.
+    void waitForJobsToLeavePool()
+    {
+        if (channelPool != nullptr)
+            for (auto& job : jobs)
+                channelPool->waitForJobToFinish(job.get(), -1);
+    }
+
+    class ChannelGroupJob : public juce::ThreadPoolJob
+    {
+    public:
+        ChannelGroupJob(LowpassResonantProcessor& p) : juce::ThreadPoolJob("LPF channel group"), owner(p) {}
+
+        JobStatus runJob() override
+        {
+            if (claimed.exchange(true))
+                return jobHasFinished; // withdrawn by the audio thread
+
+            owner.processPendingGroups();
+            if (--owner.pendingJobs == 0)
+                owner.jobsFinished.signal();
+            return jobHasFinished;
+        }
+
+        std::atomic<bool> claimed {false}; // set by whichever of worker or audio thread gets it first
+        bool dispatched = false;           // audio thread only
+
+    private:
+        LowpassResonantProcessor& owner;
+    };
+
     std::atomic<float> *cutoffFreqParam = nullptr;
-    juce::SmoothedValue<float> cutoffFreqSmoothed;
     std::atomic<float> *resonanceParam = nullptr;
-    juce::SmoothedValue<float> resonanceSmoothed;
+    const ModulationBlock& modulation;
+    juce::Range<float> cutoffRange;
 
     float currentSampleRate{ 0.0 };
-    float cutoffFreq {0.0}; // cut_lp
-    float resonance {0.0}; // res_lp
     float timeIncrement {1.0};
-    float feedback {0.0};
-    float ln3, ln4 {0.0};
-    float rn3, rn4 {0.0};
+
+    std::vector<LowpassChannelGroup> groups;
+
+    // channel-parallel processing
+    std::atomic<juce::ThreadPool*> dispatchPool {nullptr};
+    juce::ThreadPool* channelPool = nullptr; // last pool jobs were handed to
+    std::vector<std::unique_ptr<ChannelGroupJob>> jobs;
+    std::atomic<int> nextGroup {0};
+    std::atomic<int> pendingJobs {0};
+    juce::WaitableEvent jobsFinished;
+    juce::AudioBuffer<float>* currentBuffer = nullptr;
+    float cutoffTarget {0.0};
+    float resonanceTarget {0.0};
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LowpassResonantProcessor)
 };
@@ -122,23 +322,42 @@ private:
 class GainProcessor : public ProcessorBase
 {
 public:
-    GainProcessor(juce::AudioProcessorValueTreeState& vts)
+    GainProcessor(juce::AudioProcessorValueTreeState& vts, const ModulationBlock& mod)
+        : modulation(mod)
     {
         gainLevelParameter  = vts.getRawParameterValue ("gainLevel");
     }
 
     ~GainProcessor() override {}
     
-    void prepareToPlay(double sampleRate, int samplesPerBlock) override {}
+    void prepareToPlay(double sampleRate, int samplesPerBlock) override
+    {
+        gainLevel = *gainLevelParameter;
+    }
 
+    // gain is ramped between control points, so modulation doesn't zipper
     void processBlock(juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages) override
     {
-        for (int channel = 0; channel < buffer.getNumChannels(); ++channel) {
-            float* channelData = buffer.getWritePointer(channel);
+        const float gainBase = *gainLevelParameter;
+        
+        int start = 0;
+        for (int segment = 0; segment < modulation.numSegments; segment++) {
+            const int end = modulation.getSegmentEnd(segment);
+            const float gainEnd  = juce::jlimit(0.0f, 1.0f, gainBase + modulation.get(ModTarget::gain, segment));
+            const float gainStep = (gainEnd - gainLevel) / (float) (end - start);
             
-            for (int sample = 0; sample < buffer.getNumSamples(); ++sample) {
-                channelData[sample] *= *gainLevelParameter;
+            for (int channel = 0; channel < buffer.getNumChannels(); ++channel) {
+                float* channelData = buffer.getWritePointer(channel);
+                float gain = gainLevel;
+                
+                for (int sample = start; sample < end; ++sample) {
+                    gain += gainStep;
+                    channelData[sample] *= gain;
+                }
             }
+            
+            gainLevel = gainEnd;
+            start = end;
         }
     }
     
@@ -148,6 +367,8 @@ public:
 
 private:
     std::atomic<float> *gainLevelParameter = nullptr;
+    const ModulationBlock& modulation;
+    float gainLevel {1.0};
     
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(GainProcessor)
 };
@@ -0,0 +1,594 @@
+/* ==============================================================================
+    SessionTrace.h
+    Author:  Fernando Quinones Fernandez - https://fQfdev.com
+
+    Capture of real host sessions for offline profiling. The audio thread
+    appends records to a preallocated lock-free ring, a writer thread drains
+    the ring to a binary trace file, and SessionTraceReader plays it back
+    (see Tools/TraceReplay).
+
+    File layout (little-endian; records are copied in native byte order,
+    which is little-endian on every platform the plugin targets):
+      header  "SSTR", version, sampleRate (f64), blockSize, numChannels,
+              stage layout (string), numParams, param IDs (strings)
+      records 'P' sampleRate (f64), blockSize, numChannels    - prepareToPlay
+              'R'                                              - releaseResources
+              'B' flags (u8), numSamples, numChannels, bpm (f64), ppq (f64),
+                  param values (f32 x numParams),
+                  input audio (f32 x numSamples, channel after channel)
+              'L' numStages (u8), stage types (u8 x numStages)
+                                                               - stage chain in use, after
+                                                                 prepareToPlay and whenever a
+                                                                 new plan is swapped in
+              'D' count                                        - blocks dropped since the
+                                                                 previous record, ring full
+  ============================================================================== */
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "ProcessingPlan.h"
+
+#if JUCE_WINDOWS
+ #include <fcntl.h>
+ #include <io.h>
+ #include <process.h>
+ #include <sys/stat.h>
+#else
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif
+
+//==============================================================================
+namespace SessionTrace
+{
+    static constexpr int version = 1;
+    static constexpr const char* magic = "SSTR";
+
+    // Gives every instance its own trace next to the requested one, e.g.
+    // session-4242-3-20261018-142501.sstr, so instances and rescans never share a file.
+    inline juce::File makeUniqueTraceFile(const juce::File& requested, int instance)
+    {
+       #if JUCE_WINDOWS
+        const int processID = _getpid();
+       #else
+        const int processID = (int) getpid();
+       #endif
+
+        return requested.getSiblingFile(requested.getFileNameWithoutExtension()
+                                        + "-" + juce::String(processID)
+                                        + "-" + juce::String(instance)
+                                        + "-" + juce::Time::getCurrentTime().formatted("%Y%m%d-%H%M%S")
+                                        + requested.getFileExtension());
+    }
+
+    // Creates the file only if it doesn't exist yet, so an existing trace is never
+    // truncated or written into by a second recorder.
+    inline bool createExclusively(const juce::File& file)
+    {
+       #if JUCE_WINDOWS
+        const int fd = _wopen(file.getFullPathName().toWideCharPointer(),
+                              _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE);
+        if (fd < 0)
+            return false;
+        _close(fd);
+       #else
+        const int fd = ::open(file.getFullPathName().toRawUTF8(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0)
+            return false;
+        ::close(fd);
+       #endif
+        return true;
+    }
+
+    enum RecordTag : juce::uint8 { prepareTag = 'P', releaseTag = 'R', blockTag = 'B', layoutTag = 'L', droppedTag = 'D' };
+
+    static constexpr int maxLayoutStages = 255;
+
+    enum BlockFlags : juce::uint8
+    {
+        filterBypassed = 1 << 0,
+        gainBypassed   = 1 << 1,
+        nonRealtime    = 1 << 2,
+        hostPlaying    = 1 << 3
+    };
+}
+
+//==============================================================================
+class SessionRecorder : private juce::Thread
+{
+public:
+    SessionRecorder() : juce::Thread("Session trace writer") {}
+    ~SessionRecorder() override { stop(); }
+
+    //------------------------------------------------------------------------------
+    // Message thread. Creates the trace file - failing if it already exists - writes
+    // its header and preallocates the ring. Parameter values are read through the
+    // given pointers on every block.
+    bool start(const juce::File& traceFile,
+               const juce::StringArray& parameterIDs,
+               const std::vector<std::atomic<float>*>& parameterValues,
+               const juce::String& stageLayout,
+               double sampleRate, int blockSize, int numChannels,
+               int ringBytes)
+    {
+        stop();
+
+        if (! SessionTrace::createExclusively(traceFile))
+            return false;
+
+        output = std::make_unique<juce::FileOutputStream>(traceFile);
+        if (output->failedToOpen())
+        {
+            output.reset();
+            return false;
+        }
+
+        output->write(SessionTrace::magic, 4);
+        output->writeInt(SessionTrace::version);
+        output->writeDouble(sampleRate);
+        output->writeInt(blockSize);
+        output->writeInt(numChannels);
+        output->writeString(stageLayout);
+        output->writeInt(parameterIDs.size());
+        for (auto& id : parameterIDs)
+            output->writeString(id);
+
+        params = parameterValues;
+        ring.assign((size_t) ringBytes, 0);
+        fifo.setTotalSize(ringBytes);
+        fifo.reset();
+        pendingDrops = 0;
+        dropsAfterLayout = 0;
+        layoutPending = false;
+
+        capturing = true;
+        startThread();
+        return true;
+    }
+
+    // Message thread. Waits for the audio thread to leave the ring, then lets
+    // the writer drain what is left and closes the file.
+    void stop()
+    {
+        capturing = false;
+        while (audioThreadBusy)
+            juce::Thread::yield();
+
+        if (isThreadRunning())
+        {
+            // the audio thread is out, so this is now the only writer
+            writePending();
+
+            signalThreadShouldExit();
+            notify();
+            waitForThreadToExit(-1);
+        }
+
+        output.reset();
+    }
+
+    bool isCapturing() const { return capturing; }
+
+    //------------------------------------------------------------------------------
+    // Called from prepareToPlay / releaseResources, which aren't realtime, so these
+    // wait for the writer to make room rather than lose the record.
+    void recordPrepare(double sampleRate, int blockSize, int numChannels)
+    {
+        AudioThreadScope scope(*this);
+        if (! scope.active)
+            return;
+
+        retryUntilWritten([&]
+        {
+            if (! writePending())
+                return false;
+
+            RingWriter writer(*this, 1 + 8 + 4 + 4);
+            if (! writer.reserved)
+                return false;
+
+            writer.write((juce::uint8) SessionTrace::prepareTag);
+            writer.write(sampleRate);
+            writer.write(blockSize);
+            writer.write(numChannels);
+            return true;
+        });
+    }
+
+    void recordRelease()
+    {
+        AudioThreadScope scope(*this);
+        if (! scope.active)
+            return;
+
+        retryUntilWritten([&]
+        {
+            if (! writePending())
+                return false;
+
+            RingWriter writer(*this, 1);
+            if (! writer.reserved)
+                return false;
+
+            writer.write((juce::uint8) SessionTrace::releaseTag);
+            return true;
+        });
+    }
+
+    // From prepareToPlay with waitForSpace, or from the audio thread when a new
+    // plan is swapped in. If the ring is full there, the layout is held back and
+    // written ahead of the next record that fits.
+    void recordLayout(const juce::Array<StageType>& layout, bool waitForSpace)
+    {
+        AudioThreadScope scope(*this);
+        if (! scope.active)
+            return;
+
+        // a previous change that never made it is superseded; its gap merges with ours
+        if (layoutPending)
+        {
+            pendingDrops += dropsAfterLayout;
+            dropsAfterLayout = 0;
+        }
+
+        pendingLayoutSize = juce::jmin(layout.size(), SessionTrace::maxLayoutStages);
+        for (int i = 0; i < pendingLayoutSize; i++)
+            pendingLayout[(size_t) i] = (juce::uint8) layout[i];
+        layoutPending = true;
+
+        if (waitForSpace)
+            retryUntilWritten([this] { return writePending(); });
+        else
+            writePending();
+    }
+
+    //------------------------------------------------------------------------------
+    // Audio thread. Records are written whole or not at all.
+
+    void recordBlock(const juce::AudioBuffer<float>& input, juce::uint8 flags, double bpm, double ppq)
+    {
+        AudioThreadScope scope(*this);
+        if (! scope.active)
+            return;
+
+        if (! writePending())
+        {
+            countDroppedBlock();
+            return;
+        }
+
+        const int numChannels = input.getNumChannels();
+        const int numSamples  = input.getNumSamples();
+        const int audioBytes  = numChannels * numSamples * (int) sizeof(float);
+
+        RingWriter writer(*this, 1 + 1 + 4 + 4 + 8 + 8 + (int) params.size() * 4 + audioBytes);
+        if (! writer.reserved)
+        {
+            countDroppedBlock();
+            return;
+        }
+
+        writer.write((juce::uint8) SessionTrace::blockTag);
+        writer.write(flags);
+        writer.write(numSamples);
+        writer.write(numChannels);
+        writer.write(bpm);
+        writer.write(ppq);
+        for (auto* value : params)
+            writer.write(value->load());
+        for (int channel = 0; channel < numChannels; channel++)
+            writer.writeBytes(input.getReadPointer(channel), numSamples * (int) sizeof(float));
+    }
+
+private:
+    //------------------------------------------------------------------------------
+    // stop() must not return while the audio thread is still writing, so the
+    // audio thread flags itself busy and then checks capturing again.
+    struct AudioThreadScope
+    {
+        AudioThreadScope(SessionRecorder& r) : recorder(r)
+        {
+            if (! recorder.capturing)
+                return;
+
+            recorder.audioThreadBusy = true;
+            active = recorder.capturing;
+        }
+
+        ~AudioThreadScope() { recorder.audioThreadBusy = false; }
+
+        SessionRecorder& recorder;
+        bool active = false;
+    };
+
+    // Writes whatever couldn't fit earlier, in the order it happened: blocks dropped,
+    // a held-back layout, then blocks dropped after it. Returns false if it doesn't
+    // all fit yet, so that newer records wait behind it.
+    bool writePending()
+    {
+        if (! writeDrops(pendingDrops))
+            return false;
+
+        if (layoutPending)
+        {
+            RingWriter writer(*this, 1 + 1 + pendingLayoutSize);
+            if (! writer.reserved)
+                return false;
+
+            writer.write((juce::uint8) SessionTrace::layoutTag);
+            writer.write((juce::uint8) pendingLayoutSize);
+            writer.writeBytes(pendingLayout.data(), pendingLayoutSize);
+
+            layoutPending = false;
+            pendingDrops = dropsAfterLayout;
+            dropsAfterLayout = 0;
+        }
+
+        return writeDrops(pendingDrops);
+    }
+
+    bool writeDrops(int& count)
+    {
+        if (count == 0)
+            return true;
+
+        RingWriter writer(*this, 1 + 4);
+        if (! writer.reserved)
+            return false;
+
+        writer.write((juce::uint8) SessionTrace::droppedTag);
+        writer.write(count);
+        count = 0;
+        return true;
+    }
+
+    void countDroppedBlock()
+    {
+        if (layoutPending)
+            ++dropsAfterLayout;
+        else
+            ++pendingDrops;
+    }
+
+    template <typename Attempt>
+    void retryUntilWritten(Attempt&& attempt)
+    {
+        while (! attempt() && capturing)
+        {
+            notify(); // wake the writer to drain
+            juce::Thread::sleep(1);
+        }
+    }
+
+    // Reserves a whole record in the ring and copies fields across the wrap.
+    struct RingWriter
+    {
+        RingWriter(SessionRecorder& r, int numBytes) : recorder(r), size(numBytes)
+        {
+            recorder.fifo.prepareToWrite(size, start1, size1, start2, size2);
+            reserved = size1 + size2 == size;
+        }
+
+        ~RingWriter()
+        {
+            if (reserved)
+                recorder.fifo.finishedWrite(size);
+        }
+
+        template <typename Type>
+        void write(Type value) { writeBytes(&value, (int) sizeof(Type)); }
+
+        void writeBytes(const void* source, int numBytes)
+        {
+            auto* src = static_cast<const char*>(source);
+            while (numBytes > 0)
+            {
+                const bool first = written < size1;
+                const int index  = first ? start1 + written : start2 + (written - size1);
+                const int space  = first ? size1 - written : size1 + size2 - written;
+                const int chunk  = juce::jmin(numBytes, space);
+
+                std::memcpy(recorder.ring.data() + index, src, (size_t) chunk);
+                src      += chunk;
+                written  += chunk;
+                numBytes -= chunk;
+            }
+        }
+
+        SessionRecorder& recorder;
+        int size, start1, size1, start2, size2;
+        int written = 0;
+        bool reserved = false;
+    };
+
+    //------------------------------------------------------------------------------
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            drain();
+            wait(20);
+        }
+        drain();
+        output->flush();
+    }
+
+    void drain()
+    {
+        int start1, size1, start2, size2;
+        fifo.prepareToRead(fifo.getNumReady(), start1, size1, start2, size2);
+        output->write(ring.data() + start1, (size_t) size1);
+        output->write(ring.data() + start2, (size_t) size2);
+        fifo.finishedRead(size1 + size2);
+    }
+
+    std::unique_ptr<juce::FileOutputStream> output;
+    std::vector<std::atomic<float>*> params;
+    std::vector<char> ring;
+    juce::AbstractFifo fifo {1};
+    std::atomic<bool> capturing {false};
+    std::atomic<bool> audioThreadBusy {false};
+
+    // Records held back because the ring was full - written by the audio thread,
+    // then by stop() once it has left
+    int pendingDrops {0};
+    int dropsAfterLayout {0};
+    bool layoutPending {false};
+    int pendingLayoutSize {0};
+    std::array<juce::uint8, SessionTrace::maxLayoutStages> pendingLayout {};
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SessionRecorder)
+};
+
+//==============================================================================
+struct SessionTraceRecord
+{
+    enum class Type { prepare, release, block, layout, dropped };
+
+    Type type = Type::block;
+    double sampleRate = 0.0;  // prepare
+    int blockSize = 0;        // prepare
+    int numChannels = 0;      // prepare, block
+    int numSamples = 0;       // block
+    juce::uint8 flags = 0;    // block
+    double bpm = 0.0;         // block
+    double ppq = 0.0;         // block
+    std::vector<float> parameterValues;
+    juce::AudioBuffer<float> audio;
+    juce::Array<StageType> layout; // layout
+    int numDropped = 0;       // dropped
+};
+
+//==============================================================================
+class SessionTraceReader
+{
+public:
+    SessionTraceReader(const juce::File& traceFile)
+        : fileStream(traceFile), input(&fileStream, 1 << 20, false)
+    {
+        if (fileStream.failedToOpen())
+            return;
+
+        // A header with no records after it is still a valid (empty) trace, so
+        // check that each field was there to read rather than that more follows.
+        auto hasBytes = [this] (juce::int64 numBytes) { return input.getNumBytesRemaining() >= numBytes; };
+
+        char header[4];
+        if (input.read(header, 4) != 4 || std::memcmp(header, SessionTrace::magic, 4) != 0)
+            return;
+        if (! hasBytes(4 + 8 + 4 + 4) || input.readInt() != SessionTrace::version)
+            return;
+
+        sampleRate  = input.readDouble();
+        blockSize   = input.readInt();
+        numChannels = input.readInt();
+
+        if (! hasBytes(1)) // strings are null-terminated, so even an empty one is a byte
+            return;
+        stageLayout = input.readString();
+
+        if (! hasBytes(4))
+            return;
+        const int numParams = input.readInt();
+        for (int i = 0; i < numParams; i++)
+        {
+            if (! hasBytes(1))
+                return;
+            parameterIDs.add(input.readString());
+        }
+
+        valid = true;
+    }
+
+    bool openedOk() const { return valid; }
+
+    // play config at the time capture started - zero if it started before prepareToPlay
+    double getSampleRate() const                    { return sampleRate; }
+    int getBlockSize() const                        { return blockSize; }
+    int getNumChannels() const                      { return numChannels; }
+    const juce::String& getStageLayout() const      { return stageLayout; }
+    const juce::StringArray& getParameterIDs() const { return parameterIDs; }
+
+    // Returns false at the end of the trace, or if it is truncated.
+    bool readNext(SessionTraceRecord& record)
+    {
+        if (! valid || input.isExhausted())
+            return false;
+
+        switch (input.readByte())
+        {
+            case SessionTrace::prepareTag:
+                record.type        = SessionTraceRecord::Type::prepare;
+                record.sampleRate  = input.readDouble();
+                record.blockSize   = input.readInt();
+                record.numChannels = input.readInt();
+                break;
+
+            case SessionTrace::releaseTag:
+                record.type = SessionTraceRecord::Type::release;
+                break;
+
+            case SessionTrace::layoutTag:
+            {
+                record.type = SessionTraceRecord::Type::layout;
+                record.layout.clearQuick();
+
+                const int numStages = (juce::uint8) input.readByte();
+                for (int i = 0; i < numStages; i++)
+                {
+                    const int type = (juce::uint8) input.readByte();
+                    if (type < numStageTypes)
+                        record.layout.add((StageType) type);
+                }
+                break;
+            }
+
+            case SessionTrace::droppedTag:
+                record.type       = SessionTraceRecord::Type::dropped;
+                record.numDropped = input.readInt();
+                break;
+
+            case SessionTrace::blockTag:
+            {
+                record.type        = SessionTraceRecord::Type::block;
+                record.flags       = (juce::uint8) input.readByte();
+                record.numSamples  = input.readInt();
+                record.numChannels = input.readInt();
+                record.bpm         = input.readDouble();
+                record.ppq         = input.readDouble();
+
+                record.parameterValues.resize((size_t) parameterIDs.size());
+                for (auto& value : record.parameterValues)
+                    value = input.readFloat();
+
+                record.audio.setSize(record.numChannels, record.numSamples, false, false, true);
+                const int channelBytes = record.numSamples * (int) sizeof(float);
+                for (int channel = 0; channel < record.numChannels; channel++)
+                    if (input.read(record.audio.getWritePointer(channel), channelBytes) != channelBytes)
+                        return false;
+                break;
+            }
+
+            default:
+                jassertfalse; // corrupt trace
+                valid = false;
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+    juce::FileInputStream fileStream;
+    juce::BufferedInputStream input;
+
+    bool valid = false;
+    double sampleRate = 0.0;
+    int blockSize = 0;
+    int numChannels = 0;
+    juce::String stageLayout;
+    juce::StringArray parameterIDs;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SessionTraceReader)
+};
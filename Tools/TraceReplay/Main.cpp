@@ -0,0 +1,248 @@
+/*
+  ==============================================================================
+
+    TraceReplay - feeds a session trace captured by StripAudioProcessor back
+    through the processor and reports per-block timings.
+    Author:  Fernando Quinones Fernandez - https://fQfdev.com
+
+    Usage: TraceReplay <trace.sstr> [--repeat=N] [--csv=timings.csv]
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include <iostream>
+#include "../../Source/PluginProcessor.h"
+
+juce::AudioProcessor* JUCE_CALLTYPE createPluginFilter();
+
+//==============================================================================
+// Plays back the transport recorded with each block, so tempo-synced
+// modulation follows the same path it did in the host.
+class TracePlayHead : public juce::AudioPlayHead
+{
+public:
+    juce::Optional<PositionInfo> getPosition() const override { return position; }
+
+    void setFromRecord(const SessionTraceRecord& record)
+    {
+        position = {};
+        if (record.bpm > 0.0)
+            position.setBpm(record.bpm);
+
+        const bool playing = (record.flags & SessionTrace::hostPlaying) != 0;
+        position.setIsPlaying(playing);
+        if (playing)
+            position.setPpqPosition(record.ppq);
+    }
+
+private:
+    PositionInfo position;
+};
+
+struct BlockTiming
+{
+    int index;
+    int numSamples;
+    double microseconds;
+    double budgetMicroseconds; // real-time length of the block
+};
+
+//==============================================================================
+static void prepare(StripAudioProcessor& strip, juce::AudioBuffer<float>& buffer,
+                    double sampleRate, int blockSize, int numChannels)
+{
+    strip.setPlayConfigDetails(numChannels, numChannels, sampleRate, blockSize);
+    strip.prepareToPlay(sampleRate, blockSize);
+    buffer.setSize(numChannels, blockSize);
+}
+
+static void printSummary(std::vector<BlockTiming> timings, int numDropped)
+{
+    if (timings.empty())
+    {
+        std::cout << "No blocks in trace." << std::endl;
+        return;
+    }
+
+    double total = 0.0;
+    for (auto& timing : timings)
+        total += timing.microseconds;
+
+    std::sort(timings.begin(), timings.end(),
+              [] (const BlockTiming& a, const BlockTiming& b) { return a.microseconds < b.microseconds; });
+
+    auto percentile = [&timings] (double p)
+    {
+        return timings[(size_t) juce::jmin((int) timings.size() - 1, (int) (p * (double) timings.size()))].microseconds;
+    };
+
+    std::cout << "blocks:   " << timings.size() << " (" << numDropped << " dropped during capture)" << std::endl
+              << "total:    " << total / 1000.0 << " ms" << std::endl
+              << "mean:     " << total / (double) timings.size() << " us" << std::endl
+              << "median:   " << percentile(0.5) << " us" << std::endl
+              << "p99:      " << percentile(0.99) << " us" << std::endl
+              << "max:      " << timings.back().microseconds << " us" << std::endl
+              << std::endl << "slowest blocks (index, samples, us, % of real-time budget):" << std::endl;
+
+    for (size_t i = timings.size(); i-- > 0 && i + 10 >= timings.size();)
+    {
+        auto& timing = timings[i];
+        std::cout << "  " << timing.index << ", " << timing.numSamples << ", " << timing.microseconds << ", "
+                  << (timing.budgetMicroseconds > 0.0 ? 100.0 * timing.microseconds / timing.budgetMicroseconds : 0.0)
+                  << "%" << std::endl;
+    }
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    juce::ScopedJuceInitialiser_GUI juceInitialiser; // the parameter tree needs a message manager
+
+    juce::ArgumentList args (argc, argv);
+    if (args.size() < 1)
+    {
+        std::cerr << "Usage: TraceReplay <trace.sstr> [--repeat=N] [--csv=timings.csv]" << std::endl;
+        return 1;
+    }
+
+    const auto traceFile = args[0].resolveAsFile();
+    const int repeats    = juce::jmax(1, args.getValueForOption("--repeat").getIntValue());
+    const auto csvPath   = args.getValueForOption("--csv");
+
+    // never record the replay itself, even with SIMPLESTRIP_TRACE still exported
+    StripAudioProcessor::setEnvironmentCaptureEnabled(false);
+    std::unique_ptr<juce::AudioProcessor> plugin (createPluginFilter());
+    auto& strip = dynamic_cast<StripAudioProcessor&>(*plugin);
+
+    TracePlayHead playHead;
+    strip.setPlayHead(&playHead);
+
+    std::vector<BlockTiming> timings;
+    int numDropped = 0;
+    int blockIndex = 0;
+
+    for (int pass = 0; pass < repeats; pass++)
+    {
+        SessionTraceReader reader (traceFile);
+        if (! reader.openedOk())
+        {
+            std::cerr << "Could not read trace " << traceFile.getFullPathName() << std::endl;
+            return 1;
+        }
+
+        // map trace parameters onto ours by ID, so older traces still replay
+        std::vector<juce::RangedAudioParameter*> tracedParameters;
+        for (auto& id : reader.getParameterIDs())
+        {
+            juce::RangedAudioParameter* match = nullptr;
+            for (auto* parameter : strip.getParameters())
+                if (auto* ranged = dynamic_cast<juce::RangedAudioParameter*>(parameter))
+                    if (ranged->paramID == id)
+                        match = ranged;
+            tracedParameters.push_back(match);
+        }
+
+        strip.setStageLayoutNow(stageLayoutFromString(reader.getStageLayout()));
+
+        juce::AudioBuffer<float> buffer;
+        juce::MidiBuffer midi;
+        double sampleRate = reader.getSampleRate();
+        int blockSize = reader.getBlockSize();
+        int numChannels = reader.getNumChannels();
+        bool prepared = false;
+
+        if (sampleRate > 0.0)
+        {
+            prepare(strip, buffer, sampleRate, blockSize, numChannels);
+            prepared = true;
+        }
+
+        SessionTraceRecord record;
+        bool afterPrepare = false;
+        while (reader.readNext(record))
+        {
+            const bool layoutAfterPrepare = afterPrepare && record.type == SessionTraceRecord::Type::layout;
+            afterPrepare = record.type == SessionTraceRecord::Type::prepare;
+
+            switch (record.type)
+            {
+                case SessionTraceRecord::Type::prepare:
+                    sampleRate  = record.sampleRate;
+                    blockSize   = record.blockSize;
+                    numChannels = record.numChannels;
+                    prepare(strip, buffer, sampleRate, blockSize, numChannels);
+                    prepared = true;
+                    break;
+
+                case SessionTraceRecord::Type::layout:
+                    // Built here rather than on the plugin's builder thread, so the
+                    // swap lands on the same block it did in the session.
+                    if (layoutAfterPrepare)
+                    {
+                        // the session prepared straight into this layout, no crossfade
+                        if (record.layout != strip.getStageLayout())
+                        {
+                            strip.setStageLayoutNow(record.layout);
+                            prepare(strip, buffer, sampleRate, blockSize, numChannels);
+                        }
+                    }
+                    else
+                    {
+                        strip.setStageLayoutNow(record.layout);
+                    }
+                    break;
+
+                case SessionTraceRecord::Type::release:
+                    strip.releaseResources();
+                    break;
+
+                case SessionTraceRecord::Type::dropped:
+                    if (pass == 0)
+                        numDropped += record.numDropped;
+                    break;
+
+                case SessionTraceRecord::Type::block:
+                {
+                    if (! prepared)
+                        break;
+
+                    for (size_t i = 0; i < tracedParameters.size(); i++)
+                        if (auto* parameter = tracedParameters[i])
+                            parameter->setValueNotifyingHost(parameter->convertTo0to1(record.parameterValues[i]));
+
+                    strip.setStageBypassed(StageType::filter, (record.flags & SessionTrace::filterBypassed) != 0);
+                    strip.setStageBypassed(StageType::gain,   (record.flags & SessionTrace::gainBypassed) != 0);
+                    strip.setNonRealtime((record.flags & SessionTrace::nonRealtime) != 0);
+                    playHead.setFromRecord(record);
+
+                    buffer.setSize(record.numChannels, record.numSamples, false, false, true);
+                    for (int channel = 0; channel < record.numChannels; channel++)
+                        buffer.copyFrom(channel, 0, record.audio, channel, 0, record.numSamples);
+
+                    const auto start = juce::Time::getHighResolutionTicks();
+                    strip.processBlock(buffer, midi);
+                    const auto end = juce::Time::getHighResolutionTicks();
+
+                    timings.push_back({ blockIndex++, record.numSamples,
+                                        juce::Time::highResolutionTicksToSeconds(end - start) * 1.0e6,
+                                        record.numSamples / sampleRate * 1.0e6 });
+                    break;
+                }
+            }
+        }
+
+        strip.releaseResources();
+    }
+
+    if (csvPath.isNotEmpty())
+    {
+        juce::String csv ("block,samples,microseconds\n");
+        for (auto& timing : timings)
+            csv << timing.index << "," << timing.numSamples << "," << timing.microseconds << "\n";
+        juce::File::getCurrentWorkingDirectory().getChildFile(csvPath).replaceWithText(csv);
+    }
+
+    printSummary(timings, numDropped);
+    return 0;
+}